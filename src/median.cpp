@@ -11,11 +11,17 @@
 
 #define MAX_DEPTH 25
 #define MAX_OPT 9
+#define MAX_ROI 16
+
+#define STRINGIFY_(x) #x
+#define STRINGIFY(x) STRINGIFY_(x)
 
 #define PROP_FRAME "Median_frame"
 #define PROP_CLIPS "Median_clips"
 #define PROP_SYNC_RADIUS "Median_sync_radius"
 #define PROP_SYNC_METRICS "Median_sync_metrics"
+#define PROP_SYNC_OFFSET "Median_sync_offset"
+#define PROP_SYNC_SCORE "Median_sync_score"
 
 
 enum MedianFilterTypes {
@@ -41,17 +47,48 @@ enum BlendMethods {
 struct MedianData;
 
 
+struct Rect {
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+
+// Converts a rectangle given in luma coordinates to the coordinates of a
+// subsampled plane, growing it as needed so that it still covers every
+// affected chroma sample.
+static inline Rect scaleRect(const Rect &rect, int subsampling_w, int subsampling_h) {
+    int left = rect.x >> subsampling_w;
+    int top = rect.y >> subsampling_h;
+    int right = (rect.x + rect.width + (1 << subsampling_w) - 1) >> subsampling_w;
+    int bottom = (rect.y + rect.height + (1 << subsampling_h) - 1) >> subsampling_h;
+
+    return { left, top, right - left, bottom - top };
+}
+
+
+typedef double (*CompareFramesFunction)(const VSFrameRef *, const VSFrameRef *, int, const Rect *, int, const VSAPI *);
+
+
 template <typename PixelType>
-static double compareFrames(const VSFrameRef *src1, const VSFrameRef *src2, int points, const VSAPI *vsapi) {
+static double compareFrames(const VSFrameRef *src1, const VSFrameRef *src2, int points, const Rect *rois, int num_rois, const VSAPI *vsapi) {
     const PixelType *src1p = (const PixelType *)vsapi->getReadPtr(src1, 0);
     const PixelType *src2p = (const PixelType *)vsapi->getReadPtr(src2, 0);
 
-    int width = vsapi->getFrameWidth(src1, 0);
-    int height = vsapi->getFrameHeight(src1, 0);
     int stride = vsapi->getStride(src1, 0) / sizeof(PixelType);
     const VSFormat *format = vsapi->getFrameFormat(src1);
 
-    int length = width * height;
+    Rect whole_frame = { 0, 0, vsapi->getFrameWidth(src1, 0), vsapi->getFrameHeight(src1, 0) };
+
+    if (num_rois == 0) {
+        rois = &whole_frame;
+        num_rois = 1;
+    }
+
+    int length = 0;
+    for (int i = 0; i < num_rois; i++)
+        length += rois[i].width * rois[i].height;
 
     if (points < 1 || points > length)
         points = length;
@@ -63,14 +100,19 @@ static double compareFrames(const VSFrameRef *src1, const VSFrameRef *src2, int
     int64_or_float sum = 0;
     int effective_points = 0;
 
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x += step) {
-            sum += std::abs(src1p[x] - src2p[x]);
-            effective_points++;
-        }
+    for (int i = 0; i < num_rois; i++) {
+        const PixelType *roi1p = src1p + rois[i].y * stride + rois[i].x;
+        const PixelType *roi2p = src2p + rois[i].y * stride + rois[i].x;
 
-        src1p += stride;
-        src2p += stride;
+        for (int y = 0; y < rois[i].height; y++) {
+            for (int x = 0; x < rois[i].width; x += step) {
+                sum += std::abs(roi1p[x] - roi2p[x]);
+                effective_points++;
+            }
+
+            roi1p += stride;
+            roi2p += stride;
+        }
     }
 
     int pixel_max = format->sampleType == stFloat ? 1
@@ -82,6 +124,70 @@ static double compareFrames(const VSFrameRef *src1, const VSFrameRef *src2, int
 }
 
 
+// Returns the offset in [-radius, radius] of the frame from clip that best matches reference.
+static int findSyncMatch(int n, int radius, int samples, const Rect *rois, int num_rois, const VSFrameRef *reference, VSNodeRef *clip, CompareFramesFunction compare_frames, double *best, VSFrameContext *frameCtx, const VSAPI *vsapi) {
+    int match = 0;
+    *best = 0;
+
+    for (int j = -radius; j <= radius; j++) {
+        const VSFrameRef *temp = vsapi->getFrameFilter(std::max(0, n + j), clip, frameCtx);
+
+        double similarity = compare_frames(reference, temp, samples, rois, num_rois, vsapi);
+
+        if (similarity > *best) {
+            *best = similarity;
+            match = j;
+        }
+
+        vsapi->freeFrame(temp);
+    }
+
+    return match;
+}
+
+
+// Reads the optional "roi" argument, a list of x, y, width, height groups.
+// Returns an error message, or nullptr on success.
+static const char *getRois(const VSMap *in, const VSVideoInfo *vi, Rect rois[MAX_ROI], int *num_rois, const VSAPI *vsapi) {
+    int num_elements = vsapi->propNumElements(in, "roi");
+
+    *num_rois = 0;
+
+    if (num_elements <= 0)
+        return nullptr;
+
+    if (num_elements % 4)
+        return "roi must contain groups of four values: x, y, width, height.";
+
+    if (num_elements / 4 > MAX_ROI)
+        return "roi can contain at most " STRINGIFY(MAX_ROI) " rectangles.";
+
+    for (int i = 0; i < num_elements / 4; i++) {
+        Rect rect;
+        rect.x = int64ToIntS(vsapi->propGetInt(in, "roi", i * 4 + 0, nullptr));
+        rect.y = int64ToIntS(vsapi->propGetInt(in, "roi", i * 4 + 1, nullptr));
+        rect.width = int64ToIntS(vsapi->propGetInt(in, "roi", i * 4 + 2, nullptr));
+        rect.height = int64ToIntS(vsapi->propGetInt(in, "roi", i * 4 + 3, nullptr));
+
+        if (rect.x < 0 || rect.y < 0 || rect.width < 1 || rect.height < 1 ||
+                rect.width > vi->width - rect.x || rect.height > vi->height - rect.y)
+            return "roi rectangles must have positive dimensions and lie inside the frame.";
+
+        for (int j = 0; j < i; j++) {
+            if (rect.x < rois[j].x + rois[j].width && rois[j].x < rect.x + rect.width &&
+                    rect.y < rois[j].y + rois[j].height && rois[j].y < rect.y + rect.height)
+                return "roi rectangles must not overlap.";
+        }
+
+        rois[i] = rect;
+    }
+
+    *num_rois = num_elements / 4;
+
+    return nullptr;
+}
+
+
 template <typename PixelType>
 static inline void sortPixels(PixelType &a, PixelType &b) {
     PixelType min = std::min(a, b);
@@ -161,13 +267,16 @@ struct MedianData {
     int samples;
     bool debug;
 
+    Rect rois[MAX_ROI];
+    int num_rois;
+
     MedianFilterTypes filter_type;
 
     int depth;
     int blend;
 
     decltype(processPlaneFast<uint8_t, 3>) *process_plane;
-    decltype(compareFrames<uint8_t>) *compare_frames;
+    CompareFramesFunction compare_frames;
 };
 
 
@@ -308,18 +417,7 @@ static const VSFrameRef *VS_CC MedianGetFrame(int n, int activationReason, void
             for (int i = 1; i < d->depth; i++) {
                 int radius = d->sync;
 
-                for (int j = -radius; j <= radius; j++) {
-                    const VSFrameRef *temp = vsapi->getFrameFilter(std::max(0, n + j), d->clips[i], frameCtx);
-
-                    double similarity = d->compare_frames(src[0], temp, d->samples, vsapi);
-
-                    if (similarity > best[i]) {
-                        best[i] = similarity;
-                        match[i] = j;
-                    }
-
-                    vsapi->freeFrame(temp);
-                }
+                match[i] = findSyncMatch(n, radius, d->samples, d->rois, d->num_rois, src[0], d->clips[i], d->compare_frames, &best[i], frameCtx, vsapi);
 
                 src[i] = vsapi->getFrameFilter(std::max(0, n + match[i]), d->clips[i], frameCtx);
             }
@@ -333,10 +431,12 @@ static const VSFrameRef *VS_CC MedianGetFrame(int n, int activationReason, void
         if (d->filter_type == TemporalMedian)
             source_frame = src[d->low];
 
+        // With a region of interest, processed planes also start out as
+        // references to the source frame and only the ROI gets overwritten.
         const VSFrameRef *plane_src[3] = {
-            d->process[0] ? nullptr : source_frame,
-            d->process[1] ? nullptr : source_frame,
-            d->process[2] ? nullptr : source_frame
+            d->process[0] && !d->num_rois ? nullptr : source_frame,
+            d->process[1] && !d->num_rois ? nullptr : source_frame,
+            d->process[2] && !d->num_rois ? nullptr : source_frame
         };
 
         int planes[3] = { 0, 1, 2 };
@@ -347,18 +447,40 @@ static const VSFrameRef *VS_CC MedianGetFrame(int n, int activationReason, void
             if (!d->process[plane])
                 continue;
 
-            const uint8_t *srcp[MAX_DEPTH];
+            int width = vsapi->getFrameWidth(dst, plane);
+            int height = vsapi->getFrameHeight(dst, plane);
+            int stride = vsapi->getStride(dst, plane);
+
+            if (!d->num_rois) {
+                const uint8_t *srcp[MAX_DEPTH];
 
-            for (int i = 0; i < d->depth; i++)
-                srcp[i] = vsapi->getReadPtr(src[i], plane);
+                for (int i = 0; i < d->depth; i++)
+                    srcp[i] = vsapi->getReadPtr(src[i], plane);
+
+                uint8_t *dstp = vsapi->getWritePtr(dst, plane);
+
+                d->process_plane(srcp, dstp, width, height, stride, d);
+
+                continue;
+            }
+
+            int subsampling_w = plane ? d->vi->format->subSamplingW : 0;
+            int subsampling_h = plane ? d->vi->format->subSamplingH : 0;
+            int bytes = d->vi->format->bytesPerSample;
 
             uint8_t *dstp = vsapi->getWritePtr(dst, plane);
 
-            int width = vsapi->getFrameWidth(dst, plane);
-            int height = vsapi->getFrameHeight(dst, plane);
-            int stride = vsapi->getStride(dst, plane);
+            for (int r = 0; r < d->num_rois; r++) {
+                Rect rect = scaleRect(d->rois[r], subsampling_w, subsampling_h);
+                int offset = rect.y * stride + rect.x * bytes;
 
-            d->process_plane(srcp, dstp, width, height, stride, d);
+                const uint8_t *srcp[MAX_DEPTH];
+
+                for (int i = 0; i < d->depth; i++)
+                    srcp[i] = vsapi->getReadPtr(src[i], plane) + offset;
+
+                d->process_plane(srcp, dstp + offset, rect.width, rect.height, stride, d);
+            }
         }
 
 
@@ -560,6 +682,16 @@ static void VS_CC MedianCreate(const VSMap *in, VSMap *out, void *userData, VSCo
     }
 
 
+    const char *roi_error = getRois(in, d.vi, d.rois, &d.num_rois, vsapi);
+    if (roi_error) {
+        for (int j = 0; j < num_clips; j++)
+            vsapi->freeNode(d.clips[j]);
+        snprintf(error, MAX_ERROR, "%s: %s", filter_names[d.filter_type], roi_error);
+        vsapi->setError(out, error);
+        return;
+    }
+
+
     if (d.filter_type == TemporalMedian) {
         d.low = d.high = d.radius;
         d.depth = d.radius * 2 + 1;
@@ -660,6 +792,175 @@ static void VS_CC MedianCreate(const VSMap *in, VSMap *out, void *userData, VSCo
         vsapi->freeNode(clip);
     }
 }
+
+
+struct AlignData {
+    VSNodeRef *clips[MAX_DEPTH];
+    VSVideoInfo vi[MAX_DEPTH];
+
+    int num_clips;
+    int sync;
+    int samples;
+
+    Rect rois[MAX_ROI];
+    int num_rois;
+
+    CompareFramesFunction compare_frames;
+};
+
+
+static void VS_CC AlignInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
+    (void)in;
+    (void)out;
+    (void)core;
+
+    AlignData *d = (AlignData *) *instanceData;
+
+    vsapi->setVideoInfo(d->vi, d->num_clips, node);
+}
+
+
+static const VSFrameRef *VS_CC AlignGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    (void)frameData;
+
+    const AlignData *d = (const AlignData *) *instanceData;
+
+    // Each output only searches its own clip against the first one, so the
+    // cost of aligning all the clips is the same as one search in Median.
+    int index = vsapi->getOutputIndex(frameCtx);
+
+    if (activationReason == arInitial) {
+        vsapi->requestFrameFilter(n, d->clips[0], frameCtx);
+
+        if (index > 0) {
+            for (int j = -d->sync; j <= d->sync; j++)
+                vsapi->requestFrameFilter(std::max(0, n + j), d->clips[index], frameCtx);
+        }
+    } else if (activationReason == arAllFramesReady) {
+        const VSFrameRef *reference = vsapi->getFrameFilter(n, d->clips[0], frameCtx);
+
+        double best = 100.0;
+        int match = 0;
+
+        if (index > 0)
+            match = findSyncMatch(n, d->sync, d->samples, d->rois, d->num_rois, reference, d->clips[index], d->compare_frames, &best, frameCtx, vsapi);
+
+        const VSFrameRef *src = index > 0 ? vsapi->getFrameFilter(std::max(0, n + match), d->clips[index], frameCtx)
+                                          : vsapi->cloneFrameRef(reference);
+
+        vsapi->freeFrame(reference);
+
+        VSFrameRef *dst = vsapi->copyFrame(src, core);
+        vsapi->freeFrame(src);
+
+        VSMap *props = vsapi->getFramePropsRW(dst);
+
+        vsapi->propSetInt(props, PROP_SYNC_OFFSET, match, paReplace);
+        vsapi->propSetFloat(props, PROP_SYNC_SCORE, best, paReplace);
+
+        return dst;
+    }
+
+    return nullptr;
+}
+
+
+static void VS_CC AlignFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
+    (void)core;
+
+    AlignData *d = (AlignData *)instanceData;
+
+    for (int i = 0; i < MAX_DEPTH; i++)
+        vsapi->freeNode(d->clips[i]);
+
+    free(d);
+}
+
+
+static void VS_CC AlignCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    (void)userData;
+
+    AlignData d;
+    memset(&d, 0, sizeof(d));
+
+    int err;
+
+    d.sync = int64ToIntS(vsapi->propGetInt(in, "sync", 0, &err));
+    if (err)
+        d.sync = 1;
+
+    d.samples = int64ToIntS(vsapi->propGetInt(in, "samples", 0, &err));
+    if (err)
+        d.samples = 4096;
+
+
+    if (d.sync < 0) {
+        vsapi->setError(out, "Align: sync must not be negative.");
+        return;
+    }
+
+    if (d.samples < 0) {
+        vsapi->setError(out, "Align: samples must not be negative.");
+        return;
+    }
+
+    d.num_clips = vsapi->propNumElements(in, "clips");
+
+    if (d.num_clips < 2 || d.num_clips > 25) {
+        vsapi->setError(out, "Align: The number of clips must be between 2 and 25.");
+        return;
+    }
+
+    for (int i = 0; i < d.num_clips; i++) {
+        d.clips[i] = vsapi->propGetNode(in, "clips", i, nullptr);
+        d.vi[i] = *vsapi->getVideoInfo(d.clips[i]);
+    }
+
+
+    if (d.vi[0].width == 0 || d.vi[0].height == 0 ||
+            !d.vi[0].format ||
+            (d.vi[0].format->sampleType == stInteger && d.vi[0].format->bitsPerSample > 16) ||
+            (d.vi[0].format->sampleType == stFloat && d.vi[0].format->bitsPerSample != 32)) {
+        for (int j = 0; j < d.num_clips; j++)
+            vsapi->freeNode(d.clips[j]);
+        vsapi->setError(out, "Align: clips must be 8..16 bit integer or 32 bit float, with constant format and dimensions.");
+        return;
+    }
+
+    for (int i = 1; i < d.num_clips; i++) {
+        if (d.vi[0].width != d.vi[i].width || d.vi[0].height != d.vi[i].height || d.vi[0].format != d.vi[i].format) {
+            for (int j = 0; j < d.num_clips; j++)
+                vsapi->freeNode(d.clips[j]);
+            vsapi->setError(out, "Align: clips must all have the same format and dimensions.");
+            return;
+        }
+    }
+
+
+    const char *roi_error = getRois(in, &d.vi[0], d.rois, &d.num_rois, vsapi);
+    if (roi_error) {
+        for (int j = 0; j < d.num_clips; j++)
+            vsapi->freeNode(d.clips[j]);
+        char error[MAX_ERROR + 1] = { 0 };
+        snprintf(error, MAX_ERROR, "Align: %s", roi_error);
+        vsapi->setError(out, error);
+        return;
+    }
+
+
+    if (d.vi[0].format->bitsPerSample == 8)
+        d.compare_frames = compareFrames<uint8_t>;
+    else if (d.vi[0].format->bitsPerSample <= 16)
+        d.compare_frames = compareFrames<uint16_t>;
+    else if (d.vi[0].format->bitsPerSample == 32)
+        d.compare_frames = compareFrames<float>;
+
+
+    AlignData *data = (AlignData *)malloc(sizeof(d));
+    *data = d;
+
+    vsapi->createFilter(in, out, "Align", AlignInit, AlignGetFrame, AlignFree, fmParallel, 0, data, core);
+}
 #undef MAX_ERROR
 
 
@@ -671,6 +972,7 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit(VSConfigPlugin configFunc, VSRegiste
                  "samples:int:opt;"
                  "debug:int:opt;"
                  "planes:int[]:opt;"
+                 "roi:int[]:opt;"
                  , MedianCreate, (void *)Median, plugin);
 
     registerFunc(filter_names[TemporalMedian],
@@ -678,6 +980,7 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit(VSConfigPlugin configFunc, VSRegiste
                  "radius:int:opt;"
                  "debug:int:opt;"
                  "planes:int[]:opt;"
+                 "roi:int[]:opt;"
                  , MedianCreate, (void *)TemporalMedian, plugin);
 
     registerFunc(filter_names[MedianBlend],
@@ -689,5 +992,13 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit(VSConfigPlugin configFunc, VSRegiste
                  "samples:int:opt;"
                  "debug:int:opt;"
                  "planes:int[]:opt;"
+                 "roi:int[]:opt;"
                  , MedianCreate, (void *)MedianBlend, plugin);
+
+    registerFunc("Align",
+                 "clips:clip[];"
+                 "sync:int:opt;"
+                 "samples:int:opt;"
+                 "roi:int[]:opt;"
+                 , AlignCreate, nullptr, plugin);
 }